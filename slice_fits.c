@@ -19,6 +19,8 @@
 #define HEADER_MAXBLOCKS 10
 #define NAXIS_MAX 10
 #define MAX_IOVEC 1024
+#define READAHEAD_MAX (128<<10)
+#define READAHEAD_MIN (64<<10)
 
 typedef struct HeaderInfo {
 	int nblock;
@@ -215,10 +217,68 @@ int parse_sel(char * sel, HeaderInfo * info, char * header, Slice * slice) {
 	return true;
 }
 
+typedef struct ReadPlan {
+	HeaderInfo * info; Slice * slice; ssize_t wrapy;
+	char * img; ssize_t rowbytes;
+	ssize_t off[2], len[2], npiece;     // the mapped parts of each row, in bytes
+	ssize_t pre_inds[NAXIS_MAX-2], ly;  // next row to plan, like the writer loop
+	ssize_t nplanned, nwritten, done;   // rows hinted so far, rows handed to the writer so far
+	size_t pagesize; char * start, * end; // pending madvise run
+} ReadPlan;
+
+void hint_range(ReadPlan * plan, char * buf, ssize_t len) {
+	// Add buf to the pending run if their pages touch, otherwise hand the pending run
+	// to madvise and start a new one. The kernel reads at most its readahead window
+	// (128 kB by default) per MADV_WILLNEED call and silently drops the rest, so runs
+	// are passed on in READAHEAD_MAX pieces. A NULL buf flushes the run.
+	// Errors are ignored - this is just advice.
+	char * start = NULL, * end = NULL;
+	if(buf) {
+		start = (char*)((size_t)buf & ~(plan->pagesize-1));
+		end   = (char*)(((size_t)buf+len+plan->pagesize-1) & ~(plan->pagesize-1));
+		if(plan->start && start <= plan->end && end >= plan->start) {
+			if(start < plan->start) plan->start = start;
+			if(end   > plan->end)   plan->end   = end;
+			return;
+		}
+	}
+	for(char * p = plan->start; p && p < plan->end; p += READAHEAD_MAX)
+		madvise(p, imin(READAHEAD_MAX, plan->end-p), MADV_WILLNEED);
+	plan->start = start;
+	plan->end   = end;
+}
+
+void plan_rows(ReadPlan * plan) {
+	// Hint the rows the writer will read next, in the same order as the writer loop
+	// in slice_fits, up to MAX_IOVEC rows past the row it is working on. A
+	// queue never holds more than MAX_IOVEC rows, so this covers all of the next one.
+	HeaderInfo * info = plan->info; Slice * slice = plan->slice;
+	ssize_t ax;
+	for(; plan->nplanned < plan->nwritten + MAX_IOVEC && !plan->done; plan->nplanned++) {
+		ssize_t ipre = 0;
+		for(ax = slice->naxes-2-1; ax >= 0; ax--)
+			ipre = ipre * info->naxis[ax+2] + slice->i1[ax+2] + plan->pre_inds[ax];
+		ssize_t y = plan->wrapy ? imod(plan->ly, plan->wrapy) : plan->ly;
+		if(y >= 0 && y < info->naxis[1]) {
+			char * row = plan->img + (info->naxis[1]*ipre+y)*plan->rowbytes;
+			for(ssize_t i = 0; i < plan->npiece; i++)
+				hint_range(plan, row+plan->off[i], plan->len[i]);
+		}
+		if(++plan->ly < slice->y2) continue;
+		plan->ly = slice->y1;
+		for(ax = 0; ax < slice->naxes-2; ax++)
+			if(++plan->pre_inds[ax] < slice->i2[ax+2]-slice->i1[ax+2]) break;
+			else plan->pre_inds[ax] = 0;
+		plan->done = ax >= slice->naxes-2;
+	}
+	hint_range(plan, NULL, 0);
+}
+
 typedef struct WriteQueue {
 	int fd;
 	ssize_t n;
 	struct iovec ios[MAX_IOVEC];
+	ReadPlan * plan;
 } WriteQueue;
 
 int push_write(WriteQueue * queue, void * buf, ssize_t len) {
@@ -228,6 +288,9 @@ int push_write(WriteQueue * queue, void * buf, ssize_t len) {
 		// code is there to support that situation
 		ssize_t ntot = 0;
 		for(ssize_t i = 0; i < queue->n; i++) ntot += queue->ios[i].iov_len;
+		// writev blocks until the pages it reads are in, so get the kernel started on
+		// the next queue's pages first
+		if(queue->plan) plan_rows(queue->plan);
 		// Then loop over writev until we're done
 		ssize_t nwrite_tot = 0;
 		ssize_t bufi = 0;
@@ -252,6 +315,12 @@ int push_write(WriteQueue * queue, void * buf, ssize_t len) {
 	return true;
 }
 
+int is_resident(char * page) {
+	// Whether the given page of a map is in the page cache
+	unsigned char vec;
+	return mincore(page, 1, &vec) == 0 && (vec & 1);
+}
+
 int slice_fits(int ifd, int ofd, char * sel, size_t * osize) {
 	// Set up a memory map of the whole input file. We do this because we will use
 	// the mmap with writev do do the whole read/write operation in a single
@@ -322,6 +391,51 @@ int slice_fits(int ifd, int ofd, char * sel, size_t * osize) {
 	zeros = calloc(nx, nbyte);
 	void * img_start = data + info.nblock*HEADER_NROW*HEADER_NCOL;
 	if(!zeros) { code = FSLICE_EALLOC; goto cleanup; }
+
+	// Tell the kernel what we will read. A slice covering whole rows reads the image
+	// front to back, so MADV_SEQUENTIAL lets the kernel read further ahead. It also makes
+	// reclaim ignore accesses through this map, which would age the pages of a hot map
+	// we are reading, so we skip it for files that are already cached. Other slices are
+	// strided, so plan_rows hints their rows itself, one queue ahead of the writer: the
+	// rows of the first queue here, and each following queue's rows just before
+	// push_write blocks on the current one. Slices small enough for the kernel's fault
+	// readahead and files that are already cached are left alone.
+	ReadPlan plan = { &info, &slice, wrapy, img_start, info.naxis[0]*nbyte };
+	plan.pagesize = sysconf(_SC_PAGESIZE);
+	char * img_page = (char*)((size_t)img_start & ~(plan.pagesize-1));
+	// Whether the file is cached. Copying the header above faulted in the start of the
+	// file along with the kernel's readahead, so look at the middle of the image instead
+	char * probe = (char*)((size_t)(img_start + ((char*)data+flen-(char*)img_start)/2) & ~(plan.pagesize-1));
+	int cached = is_resident(probe);
+	plan.ly       = slice.y1;
+	plan.done     = ny <= 0;
+	for(ssize_t i = 0; i < slice.naxes-2; i++) {
+		plan.pre_inds[i] = 0;
+		plan.done |= slice.i2[i+2] <= slice.i1[i+2];
+	}
+	if(nx >= info.naxis[0]) {
+		if(!plan.done && !cached) madvise(img_page, (char*)data+flen-img_page, MADV_SEQUENTIAL);
+		plan.done = true;
+	} else {
+		// Find the parts of a row the writer reads. This mirrors the x logic below
+		ssize_t nloop = wrapx ? idiv(slice.x2, wrapx) : 0;
+		ssize_t x = slice.x1 - nloop*wrapx, x2 = slice.x2 - nloop*wrapx, nread = 0;
+		if(x < 0 && wrapx && x < info.naxis[0]-wrapx) {
+			ssize_t n = info.naxis[0]-wrapx-x;
+			plan.off[plan.npiece] = (info.naxis[0]-n)*nbyte; plan.len[plan.npiece++] = n*nbyte;
+			x += n;
+		}
+		if(x < 0) x = 0;
+		if(x < info.naxis[0] && x < x2) {
+			plan.off[plan.npiece] = x*nbyte; plan.len[plan.npiece++] = (imin(x2,info.naxis[0])-x)*nbyte;
+		}
+		for(ssize_t i = 0; i < plan.npiece; i++) nread += plan.len[i];
+		nread *= ny;
+		for(ssize_t i = 0; i < slice.naxes-2; i++) nread *= slice.i2[i+2]-slice.i1[i+2];
+		if(nread <= READAHEAD_MIN || cached) plan.done = true;
+	}
+	plan_rows(&plan);
+	queue.plan = &plan;
 	// any-dimensional loop over pre-axes. We will loop over only the
 	// valid values, so pre_inds is the offset from the slice starts slice.i1,
 	// and pre_lens is the number of sliced values along each axis. At the bottom
@@ -338,7 +452,7 @@ int slice_fits(int ifd, int ofd, char * sel, size_t * osize) {
 		for(ssize_t ax = slice.naxes-2-1; ax >=0 ; ax--)
 			ipre = ipre * info.naxis[ax+2] + slice.i1[ax+2] + pre_inds[ax];
 
-		for(ssize_t ly = slice.y1; ly < slice.y2; ly++) {
+		for(ssize_t ly = slice.y1; ly < slice.y2; ly++, plan.nwritten++) {
 			ssize_t y = wrapy ? imod(ly, wrapy) : ly;
 			if(y < 0 || y >= info.naxis[1]) { if(!push_write(&queue, zeros, nx*nbyte)) { code = FSLICE_EIO; goto cleanup; } }
 			else {
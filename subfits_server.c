@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -19,11 +22,16 @@
 
 #define false 0
 #define true 1
+#define PREWARM_CHUNK (128<<10)
 
 char * basedir =  ".";
 void * server_thread(void *);
 void daemonize();
 void help();
+void * prewarm_thread(void *);
+
+typedef struct { void * data; size_t len; } HotMap;
+typedef struct { char * hotfile; size_t budget; HotMap * maps; int nmap; } HotMaps;
 
 typedef struct { int code; char * name; } HTTP_code;
 enum { HTTP_200, HTTP_400, HTTP_403, HTTP_404, HTTP_405, HTTP_500 };
@@ -40,6 +48,9 @@ int main(int argc, char ** argv) {
 	int server_port = 8200, maxconn = 20, nthread = 10;
 	int daemon = false;
 	char * ofname = NULL;
+	HotMaps hot = { NULL, 0, NULL, 0 };
+	char * end;
+	pthread_t hot_thread;
 	int log_fd = 0;
 	// server configuration
 	for(int i = 1, narg = 0; i < argc; i++) {
@@ -52,6 +63,16 @@ int main(int argc, char ** argv) {
 			if(++i == argc) help();
 			ofname = argv[i];
 		}
+		else if(!strcmp(argv[i], "-c")) {
+			if(++i == argc) help();
+			hot.hotfile = argv[i];
+		}
+		else if(!strcmp(argv[i], "-m")) {
+			if(++i == argc) help();
+			long mb = strtol(argv[i], &end, 10);
+			if(!*argv[i] || *end || mb < 0) help();
+			hot.budget = (size_t)mb << 20;
+		}
 		else if(!strcmp(argv[i], "-d")) daemon = true;
 		else if(argv[i][0] == '-') help();
 		else if(narg > 0) help();
@@ -67,6 +88,15 @@ int main(int argc, char ** argv) {
 	dup2(log_fd, 1);
 	dup2(log_fd, 2);
 
+	// SIGHUP makes the prewarm thread reload the hot maps. Block it before starting any
+	// threads, so they all inherit the mask and only the sigwait in prewarm_thread sees it
+	if(hot.hotfile) {
+		sigset_t hup;
+		sigemptyset(&hup);
+		sigaddset(&hup, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &hup, NULL);
+	}
+
 	pthread_t * threads = malloc(sizeof(pthread_t)*nthread);
 	pid_t pid = getpid();
 	int server_sd = -1,  on = -1;
@@ -99,6 +129,13 @@ int main(int argc, char ** argv) {
 	printf("subfits_server with PID %d listening for connections on port %d\n", pid, ntohs(server_addr.sin6_port));
 	fflush(stdout);
 
+	// Get the hot maps into memory in the background, so we can serve requests
+	// while they load instead of refusing connections until they are done
+	if(hot.hotfile) {
+		if(pthread_create(&hot_thread, NULL, prewarm_thread, &hot)) perror("pthread_create() failed");
+		else pthread_detach(hot_thread);
+	}
+
 	server_thread(&server_sd);
 
 cleanup:
@@ -112,11 +149,9 @@ int starts_with(const char * pre, const char * str) {
 	return strncmp(pre, str, strlen(pre)) == 0;
 }
 
-void send_header(int client_sd, int log_fd, char * addr_str, char * url, int code, char * extra_fmt, ...) {
+void send_header(int client_sd, int code, char * extra_fmt, ...) {
 	int nwritten;
-	time_t rawtime;
-	struct tm * timeinfo;
-	char buf[0x1000], extra_buf[0x1000], tbuf[80];
+	char buf[0x1000], extra_buf[0x1000];
 	va_list ap;
 	// Sent header to client
 	if(!extra_fmt) extra_fmt = "";
@@ -125,14 +160,32 @@ void send_header(int client_sd, int log_fd, char * addr_str, char * url, int cod
 	va_end(ap);
 	nwritten = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s%s\r\n\r\n", http_codes[code].code, http_codes[code].name, extra_buf);
 	send(client_sd, buf, nwritten, 0);
-	// Output the log line
-	if(log_fd >= 0) {
-		time(&rawtime);
-		timeinfo = localtime(&rawtime);
-		strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", timeinfo);
-		nwritten = snprintf(buf, sizeof(buf), "%s - %20s - %d - %s\n", tbuf, addr_str, http_codes[code].code, url);
-		write(log_fd, buf, nwritten);
-	}
+}
+
+void log_request(int log_fd, char * addr_str, char * url, int code, long majflt, double dt) {
+	int nwritten;
+	time_t rawtime;
+	struct tm * timeinfo;
+	char buf[0x1000], tbuf[80];
+	if(log_fd < 0) return;
+	time(&rawtime);
+	timeinfo = localtime(&rawtime);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", timeinfo);
+	nwritten = snprintf(buf, sizeof(buf), "%s - %20s - %d - %s - %ld - %.3f\n", tbuf, addr_str, http_codes[code].code, url, majflt, dt);
+	write(log_fd, buf, nwritten);
+}
+
+double wall_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+long thread_majflt() {
+	// Major page faults (those that had to go to disk) of the calling thread so far
+	struct rusage usage;
+	if(getrusage(RUSAGE_THREAD, &usage) < 0) return 0;
+	return usage.ru_majflt;
 }
 
 int fd_readable(int fd) {
@@ -150,10 +203,13 @@ void * server_thread(void * arg) {
 	int addrlen = sizeof(client_addr);
 	char addr_str[INET6_ADDRSTRLEN];
 	char read_buf[0x1000], send_buf[0x1000], work[0x1000], orig_url[0x1000];
-	int nread, nwritten, code;
+	int nread, nwritten, code, status;
+	long majflt;
+	double t0;
 	size_t payload_size;
 	char * method, * url, * prot, * query, * saveptr, * fname, * path = 0;
 	while(true) {
+		status = -1;
 		if((client_sd = accept(server_sd, NULL, NULL)) < 0) {
 			perror("accept() failed"); goto cleanup;
 		}
@@ -164,6 +220,8 @@ void * server_thread(void * arg) {
 			perror("recv() error"); goto cleanup;
 		}
 		read_buf[nread] = 0;
+		majflt = thread_majflt();
+		t0     = wall_time();
 		//printf(read_buf);
 		// Parse the request. This has the form method url prot, key: value pairs, payload.
 		// But in our case we only care about GET, so the method url prot part should be all we
@@ -177,37 +235,39 @@ void * server_thread(void * arg) {
 		else query = 0;
 		//printf("method: %s, url: %s, query: %s, prot: %s\n", method, url, query, prot);
 		if(strcmp(method, "GET")) {
-			send_header(client_sd, log_fd, addr_str, orig_url, HTTP_405, "\r\nOnly GET is supported, but got '%s'", method);
+			send_header(client_sd, status = HTTP_405, "\r\nOnly GET is supported, but got '%s'", method);
 			goto cleanup;
 		}
 		// Build the full path, and ensure that it is still inside our basedir
 		snprintf(work, sizeof(work), "%s/%s", basedir, url);
 		path = realpath(work, NULL);
 		if(!path || !starts_with(basedir, path)) {
-			send_header(client_sd, log_fd, addr_str, orig_url, HTTP_404, NULL);
+			send_header(client_sd, status = HTTP_404, NULL);
 			goto cleanup;
 		}
 		// Try opening the file
 		if((fd = open(path, O_RDONLY)) < 0 || !fd_readable(fd)) {
-			send_header(client_sd, log_fd, addr_str, orig_url,
-					(errno == ENOENT || errno == EISDIR) ? HTTP_404 : errno == EACCES ? HTTP_403 : HTTP_500, NULL);
+			send_header(client_sd,
+					status = (errno == ENOENT || errno == EISDIR) ? HTTP_404 : errno == EACCES ? HTTP_403 : HTTP_500, NULL);
 			goto cleanup;
 		}
 		// Test if the slice etc. make sense
 		if((code = slice_fits(fd, -1, query, &payload_size)) != FSLICE_OFD) {
-			send_header(client_sd, log_fd, addr_str, orig_url, code == FSLICE_EVALS ? HTTP_400 : HTTP_500, NULL);
+			send_header(client_sd, status = code == FSLICE_EVALS ? HTTP_400 : HTTP_500, NULL);
 			goto cleanup;
 		}
 		strncpy(work, path, sizeof(work));
 		fname = basename(work);
 
 		// Ok, it looks like everything is good
-		send_header(client_sd, log_fd, addr_str, orig_url, HTTP_200,
+		send_header(client_sd, status = HTTP_200,
 				"\r\nContent-Length: %ld\r\nContent-Type: image/fits",
 				payload_size);
 		slice_fits(fd, client_sd, query, NULL);
 	
 cleanup:
+		// Log once the response is done, so the fault count and time cover the whole transfer
+		if(status >= 0) log_request(log_fd, addr_str, orig_url, status, thread_majflt()-majflt, wall_time()-t0);
 		if(client_sd >= 0) close(client_sd);
 		if(path) { free(path); path = 0; }
 		if(fd >= 0) close(fd);
@@ -216,13 +276,115 @@ cleanup:
 }
 
 void help() {
-	fprintf(stderr, "Usage subfits_server [-h] [-p PORT] [root_dir]\n");
+	fprintf(stderr, "Usage subfits_server [-h] [-p PORT] [-c FILE] [-m MB] [root_dir]\n");
 	fprintf(stderr, " -h        Print this help message and exit\n");
 	fprintf(stderr, " -p PORT   Listen on the given port. Default: 8200\n");
+	fprintf(stderr, " -c FILE   File listing hot maps (one path relative to root_dir per line) to\n");
+	fprintf(stderr, "           load at startup and keep in memory. Old files stay mapped when replaced\n");
+	fprintf(stderr, "           on disk - send SIGHUP to reload the list and release them.\n");
+	fprintf(stderr, " -m MB     Lock at most this much of the hot maps in memory. Default: 0\n");
 	fprintf(stderr, " root_dir  Server paths are relative to this directory. No access outside it allowed.\n");
 	exit(1);
 }
 
+// Map the files listed in hot->hotfile and get them into memory. As many as fit in
+// hot->budget bytes are mlocked so they stay resident, and the rest are read into the
+// page cache. The maps are kept in hot->maps until unload_hot_maps - slice_fits maps the
+// same files per request, and finds the pages already in the page cache. Problems are
+// reported but not fatal.
+void load_hot_maps(HotMaps * hot) {
+	char line[0x1000], work[0x1000], * path;
+	size_t locked = 0, budget = hot->budget;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct rlimit lim;
+	FILE * f = fopen(hot->hotfile, "r");
+	if(!f) { perror("hot map list"); return; }
+	// mlock fails beyond RLIMIT_MEMLOCK, which is small by default for non-root users
+	if(budget && geteuid() != 0 && !getrlimit(RLIMIT_MEMLOCK, &lim) && lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur < budget)
+		fprintf(stderr, "hot maps: lock budget %ld MB exceeds RLIMIT_MEMLOCK of %ld kB\n",
+				(long)(budget>>20), (long)(lim.rlim_cur>>10));
+	while(fgets(line, sizeof(line), f)) {
+		char * name = line + strspn(line, " \t");
+		name[strcspn(name, "\r\n")] = 0;
+		if(!*name || *name == '#') continue;
+		snprintf(work, sizeof(work), "%s/%s", basedir, name);
+		if(!(path = realpath(work, NULL)) || !starts_with(basedir, path)) {
+			fprintf(stderr, "hot map %s: not found\n", name);
+			if(path) free(path);
+			continue;
+		}
+		int fd = open(path, O_RDONLY);
+		free(path);
+		if(fd < 0) { perror(name); continue; }
+		size_t flen = lseek(fd, 0, SEEK_END);
+		void * data = flen ? mmap(NULL, flen, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		HotMap * maps = data != MAP_FAILED ? realloc(hot->maps, (hot->nmap+1)*sizeof(HotMap)) : NULL;
+		if(!maps) {
+			fprintf(stderr, "hot map %s: could not map\n", name);
+			if(data != MAP_FAILED) munmap(data, flen);
+			close(fd);
+			continue;
+		}
+		hot->maps = maps;
+		hot->maps[hot->nmap++] = (HotMap){ data, flen };
+#ifdef MADV_HUGEPAGE
+		// Only has an effect if the kernel supports huge pages for file maps
+		madvise(data, flen, MADV_HUGEPAGE);
+#endif
+		int lock = locked + flen <= budget;
+		if(lock && mlock(data, flen) < 0) {
+			fprintf(stderr, "hot map %s: mlock failed: %s\n", name, strerror(errno));
+			lock = false;
+		}
+		if(lock) locked += flen;
+		else {
+			// The kernel reads at most its readahead window per WILLNEED call, so queue
+			// the reads a chunk at a time, and then touch every page to wait for them
+			for(size_t off = 0; off < flen; off += PREWARM_CHUNK)
+				posix_fadvise(fd, off, PREWARM_CHUNK, POSIX_FADV_WILLNEED);
+			for(size_t off = 0; off < flen; off += pagesize)
+				(void)*(volatile char*)(data+off);
+		}
+		close(fd);
+		// Report what actually ended up in memory
+		size_t npage = (flen+pagesize-1)/pagesize, nres = 0;
+		unsigned char * vec = malloc(npage);
+		if(vec && !mincore(data, flen, vec))
+			for(size_t i = 0; i < npage; i++) nres += vec[i] & 1;
+		free(vec);
+		printf("hot map %s: %ld of %ld MB %s\n", name, (long)(nres*pagesize>>20), (long)(flen>>20),
+				lock ? "locked" : "prewarmed");
+	}
+	fclose(f);
+	fflush(stdout);
+}
+
+void unload_hot_maps(HotMaps * hot) {
+	// munmap also drops any mlock on the map
+	for(int i = 0; i < hot->nmap; i++)
+		munmap(hot->maps[i].data, hot->maps[i].len);
+	free(hot->maps);
+	hot->maps = NULL;
+	hot->nmap = 0;
+}
+
+// Loads the hot maps, and reloads them whenever we get a SIGHUP, so that maps replaced
+// on disk are released and the new files warmed.
+void * prewarm_thread(void * arg) {
+	HotMaps * hot = arg;
+	sigset_t hup;
+	int sig;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	while(true) {
+		load_hot_maps(hot);
+		if(sigwait(&hup, &sig)) break;
+		printf("hot maps: reloading %s\n", hot->hotfile);
+		unload_hot_maps(hot);
+	}
+	return 0;
+}
+
 void daemonize() {
 	pid_t child;
 	// Become own child by forking and having the parent exit